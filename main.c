@@ -19,11 +19,15 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <pango/pangocairo.h>
@@ -38,6 +42,20 @@
 #define MSDFGEN_PX_RANGE 2
 #define GLYPH_PADDING 2
 #define CACHE_FILE_NAME ".cache"
+#define GLYPH_CACHE_FILE_NAME ".glyphs"
+#define SERVER_BENCH_REQUEST_COUNT 10000
+#define SERVER_MAX_MESSAGE_SIZE (16 << 20)
+#define TILE_DATA_ALIGNMENT 4096
+#define SOA_ARRAY_ALIGNMENT 16
+#define GLYPH_TILE_NONE UINT32_MAX  // tile index of glyphs missing from the tile store
+#define SOA_VERTEX_PADDING 8  // 16 floats per array, one avx-512 register
+#define SHRINK_TO_FIT_MIN_SCALE 0.25f
+#define SHRINK_TO_FIT_ITERATIONS 8
+#define PROGRESS_TTY_INTERVAL_US 100000
+#define PROGRESS_LINE_INTERVAL_US 5000000
+#define PROGRESS_SLOW_GLYPH_FACTOR 8  // glyphs taking this many times the mean render time get reported
+#define PROGRESS_SLOW_GLYPH_MIN_SAMPLES 8
+#define DELTA_POSITION_QUANT 16  // delta encoded positions are stored in 1/16ths of a pixel
 
 // -----------------------------------------------------------------------------
 
@@ -50,7 +68,12 @@
         exit(1);                      \
     } while (0)
 
-#define Log(msg) printf("textc: %s\n", msg)
+#define Log(...)             \
+    do {                     \
+        printf("textc: ");   \
+        printf(__VA_ARGS__); \
+        printf("\n");        \
+    } while (0)
 
 // -----------------------------------------------------------------------------
 // memory
@@ -215,6 +238,83 @@ static uint32_t hash_djb2(void* data, size_t count, size_t stride) {
     return hash;
 }
 
+// -----------------------------------------------------------------------------
+// progress reporting
+//
+// On a terminal this keeps a single status line on stderr up to date. Anywhere
+// else (CI logs) it prints a key=value line every PROGRESS_LINE_INTERVAL_US
+// and when the stage ends, e.g.
+//     textc: progress stage=glyphs done=120 total=400 rate=35.1 eta=8.0
+
+typedef struct {
+    char* stage;
+    uint32_t done;
+    uint32_t total;
+    int64_t start_us;
+    int64_t last_report_us;
+    uint32_t last_report_done;
+    bool tty;
+} Progress;
+
+// rate is measured since the previous report so stalls show up immediately,
+// eta uses the average over the whole stage
+static void progress_report(Progress* progress) {
+    int64_t now = g_get_monotonic_time();
+    double elapsed = (double)(now - progress->start_us) / 1e6;
+    double interval = (double)(now - progress->last_report_us) / 1e6;
+    double rate = interval > 0. ? (progress->done - progress->last_report_done) / interval : 0.;
+    double mean_rate = elapsed > 0. ? progress->done / elapsed : 0.;
+    double eta = mean_rate > 0. ? (progress->total - progress->done) / mean_rate : 0.;
+
+    if (progress->tty) {
+        fprintf(stderr, "\r\033[Ktextc: %s %u/%u (%.1f/s, eta %.0fs)", progress->stage, progress->done, progress->total, rate, eta);
+    } else {
+        fprintf(stderr, "textc: progress stage=%s done=%u total=%u rate=%.1f eta=%.1f\n", progress->stage, progress->done, progress->total, rate, eta);
+    }
+    fflush(stderr);
+}
+
+static Progress progress_begin(char* stage, uint32_t total) {
+    Progress ret = {
+        .stage = stage,
+        .total = total,
+        .start_us = g_get_monotonic_time(),
+        .tty = isatty(STDERR_FILENO),
+    };
+    ret.last_report_us = ret.start_us;
+    return ret;
+}
+
+static void progress_step(Progress* progress) {
+    progress->done++;
+
+    int64_t now = g_get_monotonic_time();
+    int64_t interval = progress->tty ? PROGRESS_TTY_INTERVAL_US : PROGRESS_LINE_INTERVAL_US;
+    if (now - progress->last_report_us >= interval) {
+        progress_report(progress);
+        progress->last_report_us = now;
+        progress->last_report_done = progress->done;
+    }
+}
+
+static void progress_end(Progress* progress) {
+    if (progress->total == 0) return;
+    progress_report(progress);
+    if (progress->tty) fprintf(stderr, "\n");
+}
+
+// prints a full line without mangling the terminal status line
+static void progress_note(Progress* progress, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (progress->tty) fprintf(stderr, "\r\033[K");
+    fprintf(stderr, "textc: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    if (progress->tty) progress_report(progress);
+    va_end(args);
+}
+
 // -----------------------------------------------------------------------------
 // csv formats
 
@@ -229,10 +329,14 @@ typedef struct {
     TextStyle style;
 } StylesCsvEntry;
 
+#define STRING_FLAG_SHRINK_TO_FIT (1 << 0)
+#define STRING_FLAG_AUTO_PAGINATE (1 << 1)
+
 typedef struct {
     char* key;
     uint32_t width;
     uint32_t height;
+    uint32_t flags;
     char** languages;
 } StringsCsvEntry;
 
@@ -250,6 +354,7 @@ typedef struct {
 
     char** languages;
     uint32_t language_count;
+    uint32_t string_param_count;
 
     uint32_t hash;
     bool cached_hash_matched;
@@ -320,30 +425,51 @@ static void parse_styles_csv_row(Arena* arena, InputCsv* input, char** items, ui
     entry->style.lineheight = atof(items[3]);
 }
 
-#define STRINGS_CSV_PARAM_ENTRIES 3
+#define STRINGS_CSV_PARAM_ENTRIES 3  // KEY,WIDTH,HEIGHT, optionally followed by FLAGS
+
+static uint32_t parse_string_flags(char* key, char* flags) {
+    uint32_t ret = 0;
+    char* save = NULL;
+    for (char* word = strtok_r(flags, " ", &save); word; word = strtok_r(NULL, " ", &save)) {
+        if (!strcmp(word, "fit")) {
+            ret |= STRING_FLAG_SHRINK_TO_FIT;
+        } else if (!strcmp(word, "paginate")) {
+            ret |= STRING_FLAG_AUTO_PAGINATE;
+        } else {
+            Panic("strings.csv: unknown flag '%s' on '%s'", word, key);
+        }
+    }
+    return ret;
+}
 
 static void parse_strings_csv_header(Arena* arena, InputCsv* input, char** items, uint32_t item_count) {
-    Assert(item_count > STRINGS_CSV_PARAM_ENTRIES);
-    input->language_count = item_count - STRINGS_CSV_PARAM_ENTRIES;
+    input->string_param_count = STRINGS_CSV_PARAM_ENTRIES;
+    if (item_count > STRINGS_CSV_PARAM_ENTRIES && !strcmp(items[STRINGS_CSV_PARAM_ENTRIES], "FLAGS")) {
+        input->string_param_count++;
+    }
+
+    Assert(item_count > input->string_param_count);
+    input->language_count = item_count - input->string_param_count;
     input->languages = arena_alloc(arena, input->language_count * sizeof(char*));
     for (uint32_t i = 0; i < input->language_count; ++i) {
-        input->languages[i] = items[i + STRINGS_CSV_PARAM_ENTRIES];
+        input->languages[i] = items[i + input->string_param_count];
     }
 }
 
 static void parse_strings_csv_row(Arena* arena, InputCsv* input, char** items, uint32_t item_count) {
-    Assert(item_count == STRINGS_CSV_PARAM_ENTRIES + input->language_count);
+    Assert(item_count == input->string_param_count + input->language_count);
     StringsCsvEntry* entry = &input->strings[input->strings_count++];
     entry->key = items[0];
     entry->width = atoi(items[1]);
     entry->height = atoi(items[2]);
+    entry->flags = input->string_param_count > STRINGS_CSV_PARAM_ENTRIES ? parse_string_flags(entry->key, items[3]) : 0;
     entry->languages = arena_alloc(arena, input->language_count * sizeof(char*));
     for (uint32_t i = 0; i < input->language_count; ++i) {
-        entry->languages[i] = items[STRINGS_CSV_PARAM_ENTRIES + i];
+        entry->languages[i] = items[input->string_param_count + i];
     }
 }
 
-static InputCsv parse_input_files(Arena* arena) {
+static InputCsv parse_input_files(Arena* arena, uint32_t options_hash, bool use_cache) {
     Arena scratch = arena_create();
 
     InputCsv ret = {0};
@@ -357,14 +483,15 @@ static InputCsv parse_input_files(Arena* arena) {
 
     hash_djb2_acc(&ret.hash, styles_contents, styles_length, 1);
     hash_djb2_acc(&ret.hash, strings_contents, strings_length, 1);
+    hash_djb2_acc(&ret.hash, &options_hash, sizeof(options_hash), 1);
 
-    FILE* file = fopen(CACHE_FILE_NAME, "rb+");
+    // Only read here, main commits the new hash once the build has succeeded so
+    // a failed build doesn't make the next run skip straight to exit 0.
+    FILE* file = use_cache ? fopen(CACHE_FILE_NAME, "rb") : NULL;
 
     if (file) {
         uint32_t old_hash;
         FRead(&old_hash, sizeof(uint32_t), 1, file);
-        fseek(file, 0, SEEK_SET);
-        FWriteValue(uint32_t, ret.hash, file);
         fclose(file);
 
         if (old_hash == ret.hash) {
@@ -392,6 +519,7 @@ end:
 typedef struct {
     char* face;
     char* family_name;
+    uint32_t file_hash;
     PangoFontDescription* pango_font_desc;
 } LoadedFont;
 
@@ -464,10 +592,17 @@ static LoadedFonts load_fonts(Arena* arena) {
         memcpy(face, file, face_len);
         face[face_len] = 0;
 
+        Arena scratch = arena_create();
+        uint32_t file_length;
+        char* file_contents = read_file(&scratch, (char*)file, &file_length);
+
         ret.elems[i].face = face;
         ret.elems[i].family_name = (char*)family_name;
+        ret.elems[i].file_hash = hash_djb2(file_contents, file_length, 1);
         ret.elems[i].pango_font_desc = pango_font_description_from_string((const char*)family_name);
         i++;
+
+        arena_destroy(&scratch);
     }
 
     g_dir_close(dir);
@@ -480,23 +615,29 @@ static LoadedFonts load_fonts(Arena* arena) {
 
 typedef struct {
     char* face;
-    uint32_t uid;
+    uint64_t uid;
     uint32_t id;
 } GlyphId;
 
 typedef struct {
     float x0, y0, x1, y1;
+    float baseline_y;
     uint32_t source_idx;
-    uint32_t glyph_uid;
+    uint64_t glyph_uid;
 } TypesetGlyph;
 
 typedef struct _ShimRenderer {
     PangoRenderer parent_instance;
     LoadedFonts* loaded_fonts;
     char* cur_face;
+    uint64_t cur_face_uid;  // get_glyph_uid(cur_face, 0)
     uint32_t cur_source_offset;
     ArenaOf(GlyphId) used_glyphs;
+    GHashTable* used_glyph_idxs;  // &GlyphId.uid -> index in used_glyphs + 1
     ArenaOf(TypesetGlyph) typeset_glyphs;
+    bool write_debug_output;
+    uint32_t problem_count;
+    uint32_t missing_glyph_count;
 } ShimRenderer;
 
 typedef struct _ShimRendererClass {
@@ -516,6 +657,7 @@ static void shim_renderer_prepare_run(PangoRenderer* renderer0, PangoLayoutRun*
 
     PangoFontDescription* font_desc = pango_font_describe(run->item->analysis.font);
     renderer->cur_face = find_font_by_family_name(renderer->loaded_fonts, (char*)pango_font_description_get_family(font_desc))->face;
+    renderer->cur_face_uid = get_glyph_uid(renderer->cur_face, 0);
     pango_font_description_free(font_desc);
 }
 
@@ -530,6 +672,12 @@ static void shim_renderer_draw_glyphs(PangoRenderer* renderer0, PangoFont* font,
     for (int32_t i = 0; i < glyphs->num_glyphs; i++) {
         PangoGlyphInfo* gi = &glyphs->glyphs[i];
 
+        if (gi->glyph & PANGO_GLYPH_UNKNOWN_FLAG) {
+            renderer->missing_glyph_count++;
+            x_position += gi->geometry.width;
+            continue;
+        }
+
         PangoRectangle ink_extents;
         PangoRectangle logical_extents;
         pango_font_get_glyph_extents(font, gi->glyph, &ink_extents, &logical_extents);
@@ -538,31 +686,23 @@ static void shim_renderer_draw_glyphs(PangoRenderer* renderer0, PangoFont* font,
             double cx = base_x + (double)(x_position + gi->geometry.x_offset) / PANGO_SCALE;
             double cy = base_y + (double)(gi->geometry.y_offset) / PANGO_SCALE;
 
-            uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
-            uint32_t used_glyph_uid = -1;
-
-            if (gi->glyph & PANGO_GLYPH_UNKNOWN_FLAG) continue;
+            uint64_t used_glyph_uid = renderer->cur_face_uid | (uint64_t)gi->glyph;
 
-            for (uint32_t i = 0; i < used_glyph_count; ++i) {
-                GlyphId* used = ArenaGetT(GlyphId, &renderer->used_glyphs, i);
-                if (used->id == gi->glyph && !strcmp(used->face, renderer->cur_face)) {
-                    used_glyph_uid = used->uid;
-                    goto already_used;
-                }
+            if (!g_hash_table_contains(renderer->used_glyph_idxs, &used_glyph_uid)) {
+                GlyphId* used = ArenaPushT(GlyphId, &renderer->used_glyphs);
+                *used = (GlyphId){
+                    .face = renderer->cur_face,
+                    .uid = used_glyph_uid,
+                    .id = gi->glyph,
+                };
+                uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
+                g_hash_table_insert(renderer->used_glyph_idxs, &used->uid, GUINT_TO_POINTER(used_glyph_count));
             }
 
-            used_glyph_uid = get_glyph_uid(renderer->cur_face, gi->glyph);
-            *ArenaPushT(GlyphId, &renderer->used_glyphs) = (GlyphId){
-                .face = renderer->cur_face,
-                .uid = used_glyph_uid,
-                .id = gi->glyph,
-            };
-
-        already_used:
-
             *ArenaPushT(TypesetGlyph, &renderer->typeset_glyphs) = (TypesetGlyph){
                 .source_idx = glyphs->log_clusters[i] + renderer->cur_source_offset,
                 .glyph_uid = used_glyph_uid,
+                .baseline_y = (float)base_y,
                 .x0 = (float)(cx + (double)ink_extents.x / (double)PANGO_SCALE),
                 .y0 = (float)(cy + (double)ink_extents.y / (double)PANGO_SCALE),
                 .x1 = (float)(cx + (double)ink_extents.x / (double)PANGO_SCALE + (double)ink_extents.width / (double)PANGO_SCALE),
@@ -586,9 +726,22 @@ static ShimRenderer* shim_renderer_new(LoadedFonts* loaded_fonts) {
     ret->loaded_fonts = loaded_fonts;
     ret->typeset_glyphs = arena_create();
     ret->used_glyphs = arena_create();
+    ret->used_glyph_idxs = g_hash_table_new(g_int64_hash, g_int64_equal);
+    ret->write_debug_output = true;
     return ret;
 }
 
+// Rebuilds used_glyph_idxs after used_glyphs was reordered or cleared. Keys
+// point into the arena, which never moves, so only the indices go stale.
+static void shim_renderer_index_used_glyphs(ShimRenderer* renderer) {
+    g_hash_table_remove_all(renderer->used_glyph_idxs);
+    uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
+    for (uint32_t i = 0; i < used_glyph_count; ++i) {
+        GlyphId* used = ArenaGetT(GlyphId, &renderer->used_glyphs, i);
+        g_hash_table_insert(renderer->used_glyph_idxs, &used->uid, GUINT_TO_POINTER(i + 1));
+    }
+}
+
 // -----------------------------------------------------------------------------
 // atlas generation
 
@@ -676,67 +829,216 @@ static uint32_t pack_atlas_glyphs(AtlasGlyphPosition* out_positions, AtlasGlyphB
     return size;
 }
 
-static AtlasGlyphBitmap* render_glyph_msdf_bitmaps(Arena* arena, ShimRenderer* renderer) {
+// The master glyph cache holds the cropped msdf bitmap of every glyph that has
+// ever been rendered, keyed by face, font file hash and glyph id. Atlases for
+// any subset of glyphs are packed from it, so msdfgen only ever runs for glyphs
+// that no language has used before.
+typedef struct {
+    char* face;
+    uint32_t face_hash;
+    uint32_t id;
+    AtlasGlyphBitmap bitmap;
+} CachedGlyphBitmap;
+
+typedef struct {
+    Arena arena;
+    ArenaOf(CachedGlyphBitmap) entries;
+    bool loaded;
+    bool dirty;
+} GlyphBitmapCache;
+
+static void glyph_bitmap_cache_load(GlyphBitmapCache* cache) {
+    if (cache->loaded) return;
+    cache->loaded = true;
+    cache->arena = arena_create();
+    cache->entries = arena_create();
+
+    FILE* file = fopen(GLYPH_CACHE_FILE_NAME, "rb");
+    if (!file) return;
+
+    uint32_t count;
+    FRead(&count, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < count; ++i) {
+        CachedGlyphBitmap* entry = ArenaPushT(CachedGlyphBitmap, &cache->entries);
+
+        uint8_t face_len;
+        FRead(&face_len, sizeof(uint8_t), 1, file);
+        entry->face = arena_alloc(&cache->arena, face_len + 1);
+        FRead(entry->face, sizeof(char), face_len, file);
+        entry->face[face_len] = 0;
+        fseek(file, -(face_len + 1) & 3, SEEK_CUR);
+
+        FRead(&entry->face_hash, sizeof(uint32_t), 1, file);
+        FRead(&entry->id, sizeof(uint32_t), 1, file);
+        FRead(&entry->bitmap.xmin, sizeof(int32_t), 1, file);
+        FRead(&entry->bitmap.xmax, sizeof(int32_t), 1, file);
+        FRead(&entry->bitmap.ymin, sizeof(int32_t), 1, file);
+        FRead(&entry->bitmap.ymax, sizeof(int32_t), 1, file);
+
+        size_t size = (entry->bitmap.xmax - entry->bitmap.xmin) * (entry->bitmap.ymax - entry->bitmap.ymin) * 4;
+        entry->bitmap.bytes = arena_alloc(&cache->arena, size);
+        FRead(entry->bitmap.bytes, 1, size, file);
+    }
+    fclose(file);
+}
+
+static void glyph_bitmap_cache_save(GlyphBitmapCache* cache) {
+    if (!cache->dirty) return;
+
+    FILE* file = fopen(GLYPH_CACHE_FILE_NAME, "wb+");
+    if (file == NULL) Panic("Failed to open file: %s", GLYPH_CACHE_FILE_NAME);
+
+    uint32_t count = ArenaCountT(CachedGlyphBitmap, &cache->entries);
+    fwrite(&count, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < count; ++i) {
+        CachedGlyphBitmap* entry = ArenaGetT(CachedGlyphBitmap, &cache->entries, i);
+        file_write_padded_string(file, entry->face, strnlen(entry->face, 255));
+        fwrite(&entry->face_hash, sizeof(uint32_t), 1, file);
+        fwrite(&entry->id, sizeof(uint32_t), 1, file);
+        fwrite(&entry->bitmap.xmin, sizeof(int32_t), 1, file);
+        fwrite(&entry->bitmap.xmax, sizeof(int32_t), 1, file);
+        fwrite(&entry->bitmap.ymin, sizeof(int32_t), 1, file);
+        fwrite(&entry->bitmap.ymax, sizeof(int32_t), 1, file);
+        fwrite(entry->bitmap.bytes, 1, (entry->bitmap.xmax - entry->bitmap.xmin) * (entry->bitmap.ymax - entry->bitmap.ymin) * 4, file);
+    }
+    fclose(file);
+
+    cache->dirty = false;
+}
+
+static CachedGlyphBitmap* glyph_bitmap_cache_find(GlyphBitmapCache* cache, char* face, uint32_t face_hash, uint32_t id) {
+    uint32_t count = ArenaCountT(CachedGlyphBitmap, &cache->entries);
+    for (uint32_t i = 0; i < count; ++i) {
+        CachedGlyphBitmap* entry = ArenaGetT(CachedGlyphBitmap, &cache->entries, i);
+        if (entry->id == id && entry->face_hash == face_hash && !strcmp(entry->face, face)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static AtlasGlyphBitmap render_glyph_msdf_bitmap(Arena* arena, char* face, uint32_t glyph) {
     static const size_t CMD_BUF_SIZE = 1024;
     static char command[CMD_BUF_SIZE];
 
+    Arena scratch = arena_create();
+    AtlasGlyphBitmap ret;
+
+    uint32_t size;
+    snprintf(
+        command,
+        CMD_BUF_SIZE,
+        "tool/msdfgen metrics -font %s.ttf g%u -emnormalize",
+        face,
+        glyph
+    );
+
+    char* msdfgen_metrics = read_cmd(&scratch, command, &size);
+    float msdf_x0 = 0.f, msdf_y0 = 0.f, msdf_x1 = 0.f, msdf_y1 = 0.f;
+    Assert(4 == sscanf(msdfgen_metrics, "bounds = %f , %f , %f , %f", &msdf_x0, &msdf_y0, &msdf_x1, &msdf_y1));
+    int32_t x0 = (int32_t)floorf(64.f * msdf_x0);
+    int32_t x1 = (int32_t)ceilf(64.f * msdf_x1);
+    int32_t y0 = (int32_t)floorf(64.f * msdf_y0);
+    int32_t y1 = (int32_t)ceilf(64.f * msdf_y1);
+
+    snprintf(
+        command,
+        CMD_BUF_SIZE,
+        "tool/msdfgen mtsdf -font %s.ttf g%u -pxrange %u -emnormalize -translate 0.5 0.5 -scale 64 -dimensions %u %u -format bin",
+        face,
+        glyph,
+        MSDFGEN_PX_RANGE,
+        ATLAS_GLYPH_BITMAP_SIZE,
+        ATLAS_GLYPH_BITMAP_SIZE
+    );
+
+    system(command);
+    uint8_t* full_bytes = (uint8_t*)read_file(&scratch, "output.bin", &size);
+    remove("output.bin");
+    Assert(size == ATLAS_GLYPH_BITMAP_SIZE * ATLAS_GLYPH_BITMAP_SIZE * 4);
+
+    ret.xmin = 32 + x0 - GLYPH_PADDING;
+    ret.xmax = 32 + x1 + GLYPH_PADDING;
+    ret.ymin = 32 + y0 - GLYPH_PADDING;
+    ret.ymax = 32 + y1 + GLYPH_PADDING;
+
+    // keep only the glyph's own rect, rows stay bottom-up as msdfgen wrote them
+    int32_t w = ret.xmax - ret.xmin;
+    int32_t h = ret.ymax - ret.ymin;
+    ret.bytes = arena_alloc(arena, w * h * 4);
+    for (int32_t y = 0; y < h; ++y) {
+        memcpy(ret.bytes + y * w * 4, full_bytes + ((ret.ymin + y) * ATLAS_GLYPH_BITMAP_SIZE + ret.xmin) * 4, w * 4);
+    }
+
+    arena_destroy(&scratch);
+    return ret;
+}
+
+static AtlasGlyphBitmap* render_glyph_msdf_bitmaps(Arena* arena, ShimRenderer* renderer, GlyphBitmapCache* cache) {
     uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
     GlyphId* used_glyphs = (GlyphId*)renderer->used_glyphs.head;
 
     AtlasGlyphBitmap* ret = arena_alloc(arena, used_glyph_count * sizeof(AtlasGlyphBitmap));
 
+    glyph_bitmap_cache_load(cache);
+
+    // cached glyphs first, so the progress total only counts real msdfgen work
+    uint32_t miss_count = 0;
     for (int32_t i = 0; i < used_glyph_count; ++i) {
-        uint32_t glyph = used_glyphs[i].id;
-
-        uint32_t size;
-        snprintf(
-            command,
-            CMD_BUF_SIZE,
-            "tool/msdfgen metrics -font %s.ttf g%u -emnormalize",
-            used_glyphs[i].face,
-            glyph
-        );
+        char* face = used_glyphs[i].face;
+        uint32_t face_hash = find_font_by_face(renderer->loaded_fonts, face)->file_hash;
 
-        char* msdfgen_metrics = read_cmd(arena, command, &size);
-        float msdf_x0 = 0.f, msdf_y0 = 0.f, msdf_x1 = 0.f, msdf_y1 = 0.f;
-        Assert(4 == sscanf(msdfgen_metrics, "bounds = %f , %f , %f , %f", &msdf_x0, &msdf_y0, &msdf_x1, &msdf_y1));
-        int32_t x0 = (int32_t)floorf(64.f * msdf_x0);
-        int32_t x1 = (int32_t)ceilf(64.f * msdf_x1);
-        int32_t y0 = (int32_t)floorf(64.f * msdf_y0);
-        int32_t y1 = (int32_t)ceilf(64.f * msdf_y1);
-
-        snprintf(
-            command,
-            CMD_BUF_SIZE,
-            "tool/msdfgen mtsdf -font %s.ttf g%u -pxrange %u -emnormalize -translate 0.5 0.5 -scale 64 -dimensions %u %u -format bin",
-            used_glyphs[i].face,
-            glyph,
-            MSDFGEN_PX_RANGE,
-            ATLAS_GLYPH_BITMAP_SIZE,
-            ATLAS_GLYPH_BITMAP_SIZE
-        );
+        CachedGlyphBitmap* cached = glyph_bitmap_cache_find(cache, face, face_hash, used_glyphs[i].id);
+        if (cached) {
+            ret[i] = cached->bitmap;
+        } else {
+            ret[i].bytes = NULL;
+            miss_count++;
+        }
+    }
 
-        system(command);
-        ret[i].bytes = (uint8_t*)read_file(arena, "output.bin", &size);
-        remove("output.bin");
-        Assert(size == ATLAS_GLYPH_BITMAP_SIZE * ATLAS_GLYPH_BITMAP_SIZE * 4);
+    Progress progress = progress_begin("glyphs", miss_count);
+    int64_t total_render_us = 0;
+
+    for (int32_t i = 0; i < used_glyph_count; ++i) {
+        if (ret[i].bytes) continue;
 
-        ret[i].xmin = 32 + x0 - GLYPH_PADDING;
-        ret[i].xmax = 32 + x1 + GLYPH_PADDING;
-        ret[i].ymin = 32 + y0 - GLYPH_PADDING;
-        ret[i].ymax = 32 + y1 + GLYPH_PADDING;
+        char* face = used_glyphs[i].face;
+        int64_t start_us = g_get_monotonic_time();
+
+        CachedGlyphBitmap* cached = ArenaPushT(CachedGlyphBitmap, &cache->entries);
+        *cached = (CachedGlyphBitmap){
+            .face = face,
+            .face_hash = find_font_by_face(renderer->loaded_fonts, face)->file_hash,
+            .id = used_glyphs[i].id,
+            .bitmap = render_glyph_msdf_bitmap(&cache->arena, face, used_glyphs[i].id),
+        };
+        cache->dirty = true;
+        ret[i] = cached->bitmap;
+
+        int64_t render_us = g_get_monotonic_time() - start_us;
+        if (progress.done >= PROGRESS_SLOW_GLYPH_MIN_SAMPLES && render_us > PROGRESS_SLOW_GLYPH_FACTOR * total_render_us / progress.done) {
+            progress_note(
+                &progress, "slow glyph: %s g%u took %.0fms (mean %.0fms)",
+                face, used_glyphs[i].id, render_us / 1e3, total_render_us / 1e3 / progress.done
+            );
+        }
+        total_render_us += render_us;
+        progress_step(&progress);
     }
 
+    progress_end(&progress);
+    Log("rendered %u of %u glyphs, the rest were cached", miss_count, used_glyph_count);
     return ret;
 }
 
-static AtlasGlyphUv* bake_used_glyphs_to_atlas(Arena* arena, ShimRenderer* renderer) {
+static AtlasGlyphUv* bake_used_glyphs_to_atlas(Arena* arena, ShimRenderer* renderer, GlyphBitmapCache* cache, char* atlas_path) {
     uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
 
     AtlasGlyphUv* ret = arena_alloc(arena, used_glyph_count * sizeof(AtlasGlyphUv));
     Arena scratch = arena_create();
 
-    AtlasGlyphBitmap* bitmaps = render_glyph_msdf_bitmaps(&scratch, renderer);
+    AtlasGlyphBitmap* bitmaps = render_glyph_msdf_bitmaps(&scratch, renderer, cache);
 
     AtlasGlyphPosition* packed_pos = arena_alloc(&scratch, used_glyph_count * sizeof(AtlasGlyphPosition));
     uint32_t atlas_dim = pack_atlas_glyphs(packed_pos, bitmaps, used_glyph_count);
@@ -753,8 +1055,8 @@ static AtlasGlyphUv* bake_used_glyphs_to_atlas(Arena* arena, ShimRenderer* rende
         int32_t oh = bmp.ymax - bmp.ymin;
 
         int32_t oy = basey;
-        for (int32_t y = bmp.ymax - 1; y >= bmp.ymin; y--, oy++) {
-            unsigned char* src_pixels = bmp.bytes + (y * ATLAS_GLYPH_BITMAP_SIZE + bmp.xmin) * 4;
+        for (int32_t y = oh - 1; y >= 0; y--, oy++) {
+            unsigned char* src_pixels = bmp.bytes + y * ow * 4;
             unsigned char* dst_pixels = atlas + (oy * atlas_dim + basex) * 4;
             memcpy(dst_pixels, src_pixels, ow * 4);
         }
@@ -767,7 +1069,7 @@ static AtlasGlyphUv* bake_used_glyphs_to_atlas(Arena* arena, ShimRenderer* rende
         };
     }
 
-    unsigned error = lodepng_encode32_file("bin/atlas.png", atlas, atlas_dim, atlas_dim);
+    unsigned error = lodepng_encode32_file(atlas_path, atlas, atlas_dim, atlas_dim);
     if (error) Panic("Error saving PNG: %s\n", lodepng_error_text(error));
 
     arena_destroy(&scratch);
@@ -775,6 +1077,84 @@ static AtlasGlyphUv* bake_used_glyphs_to_atlas(Arena* arena, ShimRenderer* rende
     return ret;
 }
 
+// Writes every glyph bitmap into its own fixed size cell instead of packing an
+// atlas, for runtimes that page glyphs into a dynamic atlas themselves. Cells
+// are square with a power of two side that fits the largest glyph, and the tile
+// data starts page aligned so the file can be mmapped directly. Returned uvs
+// are relative to a single cell.
+//
+//     u32 magic = "TXG\0";
+//     u32 cell_size;
+//     u32 tile_count;
+//     u32 data_offset;
+//     for tile_count {
+//         u16 width, height;  // used area in the top left of the cell
+//     }
+//     u8[data_offset - 16 - 4 * tile_count] alignment;
+//     for tile_count {
+//         u8[cell_size * cell_size * 4] rgba;  // rows top to bottom
+//     }
+static AtlasGlyphUv* bake_used_glyphs_to_tiles(Arena* arena, ShimRenderer* renderer, GlyphBitmapCache* cache, char* tiles_path) {
+    static const uint8_t zeroes[TILE_DATA_ALIGNMENT] = {0};
+
+    uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
+
+    AtlasGlyphUv* ret = arena_alloc(arena, used_glyph_count * sizeof(AtlasGlyphUv));
+    Arena scratch = arena_create();
+
+    AtlasGlyphBitmap* bitmaps = render_glyph_msdf_bitmaps(&scratch, renderer, cache);
+
+    uint32_t cell_size = 1;
+    for (uint32_t i = 0; i < used_glyph_count; ++i) {
+        while (cell_size < bitmaps[i].xmax - bitmaps[i].xmin) cell_size *= 2;
+        while (cell_size < bitmaps[i].ymax - bitmaps[i].ymin) cell_size *= 2;
+    }
+
+    FILE* file = fopen(tiles_path, "wb+");
+    if (file == NULL) Panic("Failed to open file: %s", tiles_path);
+
+    uint32_t header_size = 4 * sizeof(uint32_t) + used_glyph_count * 2 * sizeof(uint16_t);
+    uint32_t data_offset = (header_size + TILE_DATA_ALIGNMENT - 1) & ~(TILE_DATA_ALIGNMENT - 1);
+
+    FWriteValue(uint32_t, 0x00475854, file);  // TXG
+    fwrite(&cell_size, sizeof(uint32_t), 1, file);
+    fwrite(&used_glyph_count, sizeof(uint32_t), 1, file);
+    fwrite(&data_offset, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < used_glyph_count; ++i) {
+        FWriteValue(uint16_t, bitmaps[i].xmax - bitmaps[i].xmin, file);
+        FWriteValue(uint16_t, bitmaps[i].ymax - bitmaps[i].ymin, file);
+    }
+    fwrite(zeroes, 1, data_offset - header_size, file);
+
+    uint8_t* cell = arena_alloc(&scratch, cell_size * cell_size * 4);
+
+    for (uint32_t i = 0; i < used_glyph_count; ++i) {
+        AtlasGlyphBitmap bmp = bitmaps[i];
+
+        int32_t ow = bmp.xmax - bmp.xmin;
+        int32_t oh = bmp.ymax - bmp.ymin;
+
+        memset(cell, 0, cell_size * cell_size * 4);
+        int32_t oy = 0;
+        for (int32_t y = oh - 1; y >= 0; y--, oy++) {
+            memcpy(cell + oy * cell_size * 4, bmp.bytes + y * ow * 4, ow * 4);
+        }
+        fwrite(cell, 1, cell_size * cell_size * 4, file);
+
+        ret[i] = (AtlasGlyphUv){
+            .u0 = (float)GLYPH_PADDING / (float)cell_size,
+            .v0 = (float)GLYPH_PADDING / (float)cell_size,
+            .u1 = (float)(GLYPH_PADDING + ow - 4) / (float)cell_size,
+            .v1 = (float)(GLYPH_PADDING + oh - 4) / (float)cell_size,
+        };
+    }
+
+    fclose(file);
+    arena_destroy(&scratch);
+
+    return ret;
+}
+
 static int32_t sort_cmp_glyph_id(const void* va, const void* vb) {
     const GlyphId *a = va, *b = vb;
 
@@ -786,14 +1166,19 @@ static int32_t sort_cmp_glyph_id(const void* va, const void* vb) {
                            : 0;
 }
 
-static AtlasGlyphUv* bake_used_glyphs_to_atlas_cached(Arena* arena, ShimRenderer* renderer, uint32_t csv_hash) {
+// With use_cache false .cache is neither read nor written, for bakes that aren't
+// part of a normal build (server mode). The csv hash slot is left zeroed until
+// write_cached_input_hash commits it.
+static AtlasGlyphUv* bake_used_glyphs_to_atlas_cached(Arena* arena, ShimRenderer* renderer, GlyphBitmapCache* cache, char* atlas_path, bool tiles, bool use_cache) {
     AtlasGlyphUv* ret = NULL;
 
     uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
     qsort(renderer->used_glyphs.head, used_glyph_count, sizeof(GlyphId), sort_cmp_glyph_id);
+    shim_renderer_index_used_glyphs(renderer);
     uint32_t new_hash = hash_djb2(renderer->used_glyphs.head + offsetof(GlyphId, uid), used_glyph_count, sizeof(GlyphId));
+    hash_djb2_acc(&new_hash, atlas_path, strlen(atlas_path), 1);
 
-    FILE* file = fopen(CACHE_FILE_NAME, "rb+");
+    FILE* file = use_cache ? fopen(CACHE_FILE_NAME, "rb+") : NULL;
     if (file) {
         fseek(file, sizeof(uint32_t), SEEK_SET);  // skip over the csv hash
         uint32_t stored_hash;
@@ -809,11 +1194,13 @@ static AtlasGlyphUv* bake_used_glyphs_to_atlas_cached(Arena* arena, ShimRenderer
         fclose(file);
     }
 
-    Log("baking atlas...");
-    ret = bake_used_glyphs_to_atlas(arena, renderer);
+    Log("baking %s...", atlas_path);
+    ret = tiles ? bake_used_glyphs_to_tiles(arena, renderer, cache, atlas_path)
+                : bake_used_glyphs_to_atlas(arena, renderer, cache, atlas_path);
+    if (!use_cache) return ret;
 
     file = fopen(CACHE_FILE_NAME, "wb+");
-    fwrite(&csv_hash, sizeof(uint32_t), 1, file);
+    FWriteValue(uint32_t, 0, file);
     fwrite(&new_hash, sizeof(uint32_t), 1, file);
     fwrite(&used_glyph_count, sizeof(uint32_t), 1, file);
     fwrite(ret, sizeof(AtlasGlyphUv), used_glyph_count, file);
@@ -821,6 +1208,13 @@ static AtlasGlyphUv* bake_used_glyphs_to_atlas_cached(Arena* arena, ShimRenderer
     return ret;
 }
 
+static void write_cached_input_hash(uint32_t csv_hash) {
+    FILE* file = fopen(CACHE_FILE_NAME, "rb+");
+    if (file == NULL) Panic("Failed to open file: %s", CACHE_FILE_NAME);
+    fwrite(&csv_hash, sizeof(uint32_t), 1, file);
+    fclose(file);
+}
+
 // -----------------------------------------------------------------------------
 // parsing and rendering strings
 
@@ -836,9 +1230,14 @@ typedef struct {
     UserTag* user_tags;
     uint32_t typeset_glyph_count;
     TypesetGlyph* typeset_glyphs;
+    int32_t layout_width;
+    int32_t layout_height;
+    uint32_t missing_glyph_count;
+    float scale;
 } RenderedPage;
 
 typedef struct {
+    uint32_t string_idx;
     uint32_t page_count;
     RenderedPage* pages;
 } RenderedString;
@@ -850,34 +1249,107 @@ static int32_t sort_cmp_glyph_source_idx(const void* va, const void* vb) {
                                            : 0;
 }
 
-static RenderedPage render_page(
+static bool layout_overflows(PangoLayout* layout, uint32_t width, uint32_t height) {
+    PangoRectangle logical_rect;
+    pango_layout_get_pixel_extents(layout, NULL, &logical_rect);
+    return logical_rect.x + logical_rect.width > (int32_t)width || logical_rect.y + logical_rect.height > (int32_t)height;
+}
+
+static void set_layout_scale(PangoLayout* layout, PangoAttrList* attr_list, float scale) {
+    PangoAttrList* scaled_attr_list = pango_attr_list_copy(attr_list);
+    PangoAttribute* attr = pango_attr_scale_new(scale);
+    attr->start_index = 0;
+    attr->end_index = PANGO_ATTR_INDEX_TO_TEXT_END;
+    pango_attr_list_insert(scaled_attr_list, attr);
+    pango_layout_set_attributes(layout, scaled_attr_list);
+    pango_attr_list_unref(scaled_attr_list);
+}
+
+// Binary searches for the largest style scale in [SHRINK_TO_FIT_MIN_SCALE, 1]
+// at which the layout fits its box, relaying out the same layout object each
+// step. Leaves the layout at the returned scale.
+static float shrink_layout_to_fit(PangoLayout* layout, PangoAttrList* attr_list, uint32_t width, uint32_t height) {
+    if (!layout_overflows(layout, width, height)) return 1.f;
+
+    float lo = SHRINK_TO_FIT_MIN_SCALE;
+    float hi = 1.f;
+    for (uint32_t i = 0; i < SHRINK_TO_FIT_ITERATIONS; ++i) {
+        float mid = 0.5f * (lo + hi);
+        set_layout_scale(layout, attr_list, mid);
+        if (layout_overflows(layout, width, height)) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    set_layout_scale(layout, attr_list, lo);
+    return lo;
+}
+
+typedef struct {
+    PangoLayoutLine* line;
+    int32_t x, baseline;  // pango units, where the line gets drawn
+    int32_t top, bottom;
+    int32_t right;
+} LaidOutLine;
+
+static LaidOutLine* collect_layout_lines(Arena* arena, PangoLayout* layout, uint32_t* out_count) {
+    LaidOutLine* ret = arena_alloc(arena, 0);
+    *out_count = 0;
+
+    PangoLayoutIter* iter = pango_layout_get_iter(layout);
+    do {
+        PangoRectangle logical_rect;
+        pango_layout_iter_get_line_extents(iter, NULL, &logical_rect);
+
+        LaidOutLine* line = ArenaPushT(LaidOutLine, arena);
+        line->line = pango_layout_iter_get_line_readonly(iter);
+        line->x = logical_rect.x;
+        line->right = logical_rect.x + logical_rect.width;
+        line->baseline = pango_layout_iter_get_baseline(iter);
+        pango_layout_iter_get_line_yrange(iter, &line->top, &line->bottom);
+        (*out_count)++;
+    } while (pango_layout_iter_next_line(iter));
+    pango_layout_iter_free(iter);
+
+    return ret;
+}
+
+// Emits the glyphs of lines [first_line, end_line) as one page, shifted up so
+// the first line's top sits at y = 0. User tags are clipped to the page's
+// source range, so a tag spanning a page boundary shows up on both pages.
+static RenderedPage render_page_lines(
     Arena* arena,
-    PangoContext* pango_context,
     ShimRenderer* renderer,
-    PangoAttrList* attr_list,
+    LaidOutLine* lines,
+    uint32_t first_line,
+    uint32_t end_line,
+    bool is_last_page,
     char* strings_table_key,
     uint32_t page_number,
     uint32_t width,
     uint32_t height,
-    char* contents,
+    float scale,
     uint32_t contents_len,
     UserTag* user_tags,
     uint32_t user_tag_count
 ) {
     char filename_buffer[256];
     arena_clear(&renderer->typeset_glyphs);
+    renderer->missing_glyph_count = 0;
 
     Arena scratch = arena_create();
 
-    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cairo_t* cr = cairo_create(surface);
+    int32_t y_top = lines[first_line].top;
+    uint32_t page_start = lines[first_line].line->start_index;
+    uint32_t page_end = is_last_page ? contents_len : lines[end_line].line->start_index;
 
-    PangoLayout* layout = pango_layout_new(pango_context);
-    pango_layout_set_width(layout, width * PANGO_SCALE);
-    pango_layout_set_height(layout, height * PANGO_SCALE);
-    pango_layout_set_text(layout, contents, -1);
-    pango_layout_set_attributes(layout, attr_list);
-    pango_renderer_draw_layout((PangoRenderer*)renderer, layout, 0, 0);
+    int32_t page_right = 0;
+    for (uint32_t i = first_line; i < end_line; ++i) {
+        pango_renderer_draw_layout_line((PangoRenderer*)renderer, lines[i].line, lines[i].x, lines[i].baseline - y_top);
+        page_right = MAX(page_right, lines[i].right);
+    }
 
     TypesetGlyph* glyphs = (TypesetGlyph*)renderer->typeset_glyphs.head;
     uint32_t glyph_count = ArenaCountT(TypesetGlyph, &renderer->typeset_glyphs);
@@ -885,32 +1357,56 @@ static RenderedPage render_page(
     // sort glyphs into logical order instead of being always left-to-right
     qsort(glyphs, glyph_count, sizeof(TypesetGlyph), sort_cmp_glyph_source_idx);
 
+    // clip user tags to this page, zero length tags at the very end of the
+    // contents belong to the last page
+    UserTag* page_tags = arena_alloc(&scratch, user_tag_count * sizeof(UserTag));
+    uint32_t page_tag_count = 0;
+    uint32_t empty_tag_end = is_last_page ? contents_len + 1 : page_end;
+    for (uint32_t i = 0; i < user_tag_count; ++i) {
+        UserTag tag = user_tags[i];
+        bool on_page = tag.start_idx == tag.end_idx
+                           ? tag.start_idx >= page_start && tag.start_idx < empty_tag_end
+                           : tag.start_idx < page_end && tag.end_idx > page_start;
+        if (!on_page) continue;
+
+        tag.start_idx = MAX(tag.start_idx, page_start);
+        tag.end_idx = MIN(tag.end_idx, page_end);
+        page_tags[page_tag_count++] = tag;
+    }
+
     // convert source string indices in user tags to glyph array indices
     {
-        uint32_t* index_map = arena_alloc(&scratch, sizeof(uint32_t) * contents_len);
-        memset(index_map, 0xFF, sizeof(uint32_t) * contents_len);
+        uint32_t* index_map = arena_alloc(&scratch, sizeof(uint32_t) * (contents_len + 1));
+        memset(index_map, 0xFF, sizeof(uint32_t) * (contents_len + 1));
 
         for (uint32_t i = 0; i < glyph_count; ++i) {
             index_map[glyphs[i].source_idx] = i;
         }
         uint32_t prev = 0;
-        for (uint32_t i = 0; i < contents_len; ++i) {
+        for (uint32_t i = 0; i <= contents_len; ++i) {
             if (index_map[i] == UINT32_MAX) {
                 index_map[i] = prev;
             } else {
                 prev = index_map[i];
             }
         }
-        for (uint32_t i = 0; i < user_tag_count; ++i) {
-            user_tags[i].start_idx = index_map[user_tags[i].start_idx];
-            user_tags[i].end_idx = index_map[user_tags[i].end_idx];
+        for (uint32_t i = 0; i < page_tag_count; ++i) {
+            page_tags[i].start_idx = index_map[page_tags[i].start_idx];
+            page_tags[i].end_idx = index_map[page_tags[i].end_idx];
         }
     }
 
 #if ENABLE_DEBUG_OUTPUT
-    if (width > 0) {
+    if (width > 0 && renderer->write_debug_output) {
+        cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        cairo_t* cr = cairo_create(surface);
+
         cairo_set_source_rgb(cr, 1, 1, 1);
-        pango_cairo_show_layout(cr, layout);
+        for (uint32_t i = first_line; i < end_line; ++i) {
+            cairo_move_to(cr, (double)lines[i].x / PANGO_SCALE, (double)(lines[i].baseline - y_top) / PANGO_SCALE);
+            pango_cairo_show_layout_line(cr, lines[i].line);
+        }
+        cairo_surface_flush(surface);
 
         unsigned char* data = cairo_image_surface_get_data(surface);
         int32_t stride = cairo_image_surface_get_stride(surface);
@@ -957,26 +1453,88 @@ static RenderedPage render_page(
         snprintf(filename_buffer, 256, "bin/%s.%u.png", strings_table_key, page_number);
         unsigned error = lodepng_encode32_file(filename_buffer, png_data, width, height);
         if (error) Panic("error saving PNG: %s\n", lodepng_error_text(error));
+
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
     }
 #endif  // ENABLE_DEBUG_OUTPUT
 
-    g_object_unref(layout);
-    cairo_destroy(cr);
-    cairo_surface_destroy(surface);
-
     RenderedPage ret = {
-        .typeset_glyph_count = ArenaCountT(TypesetGlyph, &renderer->typeset_glyphs),
+        .layout_width = PANGO_PIXELS_CEIL(page_right),
+        .layout_height = PANGO_PIXELS_CEIL(lines[end_line - 1].bottom - y_top),
+        .missing_glyph_count = renderer->missing_glyph_count,
+        .scale = scale,
+        .typeset_glyph_count = glyph_count,
         .typeset_glyphs = arena_alloc(arena, ret.typeset_glyph_count * sizeof(TypesetGlyph)),
-        .user_tag_count = user_tag_count,
+        .user_tag_count = page_tag_count,
         .user_tags = arena_alloc(arena, ret.user_tag_count * sizeof(UserTag)),
     };
-    memcpy(ret.typeset_glyphs, renderer->typeset_glyphs.head, ret.typeset_glyph_count * sizeof(TypesetGlyph));
-    memcpy(ret.user_tags, user_tags, user_tag_count * sizeof(UserTag));
+    memcpy(ret.typeset_glyphs, glyphs, ret.typeset_glyph_count * sizeof(TypesetGlyph));
+    memcpy(ret.user_tags, page_tags, page_tag_count * sizeof(UserTag));
 
     arena_destroy(&scratch);
     return ret;
 }
 
+// Lays out contents once and pushes the resulting pages to out_pages, returning
+// how many were pushed. That's always one page unless the string is auto
+// paginated, in which case the layout is only constrained in width and its
+// lines are split into as many box-height pages as needed.
+static uint32_t render_page(
+    Arena* arena,
+    PangoContext* pango_context,
+    ShimRenderer* renderer,
+    PangoAttrList* attr_list,
+    char* strings_table_key,
+    uint32_t page_number,
+    uint32_t width,
+    uint32_t height,
+    uint32_t string_flags,
+    char* contents,
+    uint32_t contents_len,
+    UserTag* user_tags,
+    uint32_t user_tag_count,
+    ArenaOf(RenderedPage) * out_pages
+) {
+    bool paginate = (string_flags & STRING_FLAG_AUTO_PAGINATE) && width > 0;
+    bool shrink_to_fit = (string_flags & STRING_FLAG_SHRINK_TO_FIT) && width > 0 && !paginate;
+
+    Arena scratch = arena_create();
+
+    PangoLayout* layout = pango_layout_new(pango_context);
+    pango_layout_set_width(layout, width * PANGO_SCALE);
+    if (!paginate) pango_layout_set_height(layout, height * PANGO_SCALE);
+    pango_layout_set_text(layout, contents, -1);
+    pango_layout_set_attributes(layout, attr_list);
+
+    float scale = shrink_to_fit ? shrink_layout_to_fit(layout, attr_list, width, height) : 1.f;
+
+    uint32_t line_count;
+    LaidOutLine* lines = collect_layout_lines(&scratch, layout, &line_count);
+
+    uint32_t first_line = 0;
+    uint32_t page_count = 0;
+    if (paginate) {
+        for (uint32_t i = 1; i < line_count; ++i) {
+            if (lines[i].bottom - lines[first_line].top > (int32_t)height * PANGO_SCALE) {
+                *ArenaPushT(RenderedPage, out_pages) = render_page_lines(
+                    arena, renderer, lines, first_line, i, false, strings_table_key, page_number + page_count++,
+                    width, height, scale, contents_len, user_tags, user_tag_count
+                );
+                first_line = i;
+            }
+        }
+    }
+    *ArenaPushT(RenderedPage, out_pages) = render_page_lines(
+        arena, renderer, lines, first_line, line_count, true, strings_table_key, page_number + page_count++,
+        width, height, scale, contents_len, user_tags, user_tag_count
+    );
+
+    g_object_unref(layout);
+    arena_destroy(&scratch);
+    return page_count;
+}
+
 static void write_style_attr_range(LoadedFonts* loaded_fonts, PangoAttrList* attr_list, TextStyle* style, uint32_t start, uint32_t end) {
     if (end <= start) return;
 
@@ -998,26 +1556,54 @@ static void write_style_attr_range(LoadedFonts* loaded_fonts, PangoAttrList* att
     pango_attr_list_insert(attr_list, attr);
 }
 
-static RenderedString render_string_entry(
+static void report_string_problem(ShimRenderer* renderer, char* language, char* key, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    flockfile(stderr);
+    if (isatty(STDERR_FILENO)) fprintf(stderr, "\r\033[K");  // clear any progress line
+    fprintf(stderr, "textc: %s/%s: ", language, key);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    funlockfile(stderr);
+    va_end(args);
+    renderer->problem_count++;
+}
+
+static void check_rendered_page(ShimRenderer* renderer, char* language, StringsCsvEntry* string, uint32_t page_number, RenderedPage* page) {
+    if (page->missing_glyph_count > 0) {
+        report_string_problem(renderer, language, string->key, "page %u: %u glyphs missing from every loaded font", page_number, page->missing_glyph_count);
+    }
+    if (string->width > 0 && (page->layout_width > string->width || page->layout_height > string->height)) {
+        report_string_problem(
+            renderer, language, string->key, "page %u: text overflows box: %dx%d > %ux%u",
+            page_number, page->layout_width, page->layout_height, string->width, string->height
+        );
+    }
+}
+
+// Renders markup contents into a box sized by the strings table entry. The
+// entry's own language columns are ignored, so ad-hoc strings can pass a
+// stack entry with just a key and box.
+static RenderedString render_markup(
     Arena* arena,
     PangoContext* pango_context,
     ShimRenderer* renderer,
     InputCsv* input,
-    uint32_t language_idx,
-    uint32_t string_idx
+    char* language,
+    StringsCsvEntry* string,
+    char* contents
 ) {
     RenderedString ret = {0};
     Arena scratch = arena_create();
 
-    char* page_buffer = arena_alloc(&scratch, input->max_string_length);
+    char* page_buffer = arena_alloc(&scratch, strlen(contents) + 1);
     ArenaOf(TextStyle*) style_history = arena_create();
     ArenaOf(UserTag) user_tag_stack = arena_create();
     ArenaOf(UserTag) user_tags = arena_create();
     ArenaOf(RenderedPage) pages_acc = arena_create();
 
-    StringsCsvEntry* string = &input->strings[string_idx];
     bool in_style_tag = false;
-    char* content_base = string->languages[language_idx];
+    char* content_base = contents;
     char* tag_start = NULL;
     char* page_read = content_base;
     char* page_write = page_buffer;
@@ -1055,27 +1641,52 @@ static RenderedString render_string_entry(
                     // empty, pop style history stack
                     if (ArenaCountT(TextStyle*, &style_history) > 0) {
                         cur_style = *ArenaPopT(TextStyle*, &style_history);
+                    } else {
+                        report_string_problem(renderer, language, string->key, "[#-] without a matching style tag");
                     }
                 } else {
                     // set new style by name
-                    for (uint32_t i = 0; i < input->styles_count; ++i) {
-                        if (!strncmp(input->styles[i].name, tag_start, tag_len)) {
+                    uint32_t i = 0;
+                    for (; i < input->styles_count; ++i) {
+                        if (strlen(input->styles[i].name) == tag_len && !strncmp(input->styles[i].name, tag_start, tag_len)) {
                             *ArenaPushT(TextStyle*, &style_history) = cur_style;
                             cur_style = &input->styles[i].style;
                             break;
                         }
                     }
+                    if (i == input->styles_count) {
+                        report_string_problem(renderer, language, string->key, "unknown style '[#-%.*s]'", tag_len, tag_start);
+                    }
                 }
             } else if (!strncmp(tag_start, ".", tag_len)) {
                 // page break
                 uint32_t attr_range_end = (uint32_t)(page_write - page_buffer);
                 write_style_attr_range(renderer->loaded_fonts, attr_list, cur_style, attr_range_start, attr_range_end);
 
+                // user tags still open carry over, closed at the end of this
+                // page and reopened at the start of the next
+                uint32_t open_tag_count = ArenaCountT(UserTag, &user_tag_stack);
+                for (uint32_t i = 0; i < open_tag_count; ++i) {
+                    UserTag* tag = ArenaGetT(UserTag, &user_tag_stack, i);
+                    *ArenaPushT(UserTag, &user_tags) = (UserTag){
+                        .value = tag->value,
+                        .value_len = tag->value_len,
+                        .start_idx = tag->start_idx,
+                        .end_idx = attr_range_end,
+                    };
+                    tag->start_idx = 0;
+                }
+
                 *page_write = 0;
-                *ArenaPushT(RenderedPage, &pages_acc) = render_page(
-                    arena, pango_context, renderer, attr_list, string->key, ret.page_count++, string->width, string->height, page_buffer, page_write - page_buffer,
-                    (UserTag*)user_tags.head, ArenaCountT(UserTag, &user_tags)
+                uint32_t first_page = ret.page_count;
+                ret.page_count += render_page(
+                    arena, pango_context, renderer, attr_list, string->key, ret.page_count, string->width, string->height,
+                    string->flags, page_buffer, page_write - page_buffer,
+                    (UserTag*)user_tags.head, ArenaCountT(UserTag, &user_tags), &pages_acc
                 );
+                for (uint32_t i = first_page; i < ret.page_count; ++i) {
+                    check_rendered_page(renderer, language, string, i, ArenaGetT(RenderedPage, &pages_acc, i));
+                }
                 page_write = page_buffer;
                 pango_attr_list_unref(attr_list);
                 attr_list = pango_attr_list_new();
@@ -1087,6 +1698,8 @@ static RenderedString render_string_entry(
                     UserTag* tag = ArenaPopT(UserTag, &user_tag_stack);
                     tag->end_idx = page_write - page_buffer;
                     *ArenaPushT(UserTag, &user_tags) = *tag;
+                } else {
+                    report_string_problem(renderer, language, string->key, "[#/] without a matching tag");
                 }
             } else {
                 // start user tag
@@ -1103,14 +1716,27 @@ static RenderedString render_string_entry(
         page_read++;
     }
 
+    if (tag_start) {
+        report_string_problem(renderer, language, string->key, "unclosed tag '[#%.16s'", tag_start);
+    }
+    for (uint32_t i = 0; i < ArenaCountT(UserTag, &user_tag_stack); ++i) {
+        UserTag* tag = ArenaGetT(UserTag, &user_tag_stack, i);
+        report_string_problem(renderer, language, string->key, "tag '[#%.*s]' is never closed with [#/]", tag->value_len, tag->value);
+    }
+
     uint32_t attr_range_end = (uint32_t)(page_write - page_buffer);
     write_style_attr_range(renderer->loaded_fonts, attr_list, cur_style, attr_range_start, attr_range_end);
 
     *page_write = 0;
-    *ArenaPushT(RenderedPage, &pages_acc) = render_page(
-        arena, pango_context, renderer, attr_list, string->key, ret.page_count++, string->width, string->height, page_buffer, page_write - page_buffer,
-        (UserTag*)user_tags.head, ArenaCountT(UserTag, &user_tags)
+    uint32_t first_page = ret.page_count;
+    ret.page_count += render_page(
+        arena, pango_context, renderer, attr_list, string->key, ret.page_count, string->width, string->height,
+        string->flags, page_buffer, page_write - page_buffer,
+        (UserTag*)user_tags.head, ArenaCountT(UserTag, &user_tags), &pages_acc
     );
+    for (uint32_t i = first_page; i < ret.page_count; ++i) {
+        check_rendered_page(renderer, language, string, i, ArenaGetT(RenderedPage, &pages_acc, i));
+    }
     pango_attr_list_unref(attr_list);
 
     ret.pages = arena_alloc(arena, ret.page_count * sizeof(RenderedPage));
@@ -1125,102 +1751,779 @@ static RenderedString render_string_entry(
     return ret;
 }
 
+static RenderedString render_string_entry(
+    Arena* arena,
+    PangoContext* pango_context,
+    ShimRenderer* renderer,
+    InputCsv* input,
+    uint32_t language_idx,
+    uint32_t string_idx
+) {
+    StringsCsvEntry* string = &input->strings[string_idx];
+    RenderedString ret = render_markup(
+        arena, pango_context, renderer, input, input->languages[language_idx], string, string->languages[language_idx]
+    );
+    ret.string_idx = string_idx;
+    return ret;
+}
+
 // -----------------------------------------------------------------------------
+// validation
+
+static uint32_t check_style_fonts(InputCsv* input, LoadedFonts* loaded_fonts) {
+    uint32_t problem_count = 0;
+    for (uint32_t i = 0; i < input->styles_count; ++i) {
+        StylesCsvEntry* entry = &input->styles[i];
+        if (!find_font_by_face(loaded_fonts, entry->style.face)) {
+            fprintf(stderr, "textc: styles.csv: style '%s' uses face '%s' but there is no %s.ttf\n", entry->name, entry->style.face, entry->style.face);
+            problem_count++;
+        }
+    }
+    return problem_count;
+}
 
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: textc [language]\n");
-        return 1;
+typedef struct {
+    InputCsv* input;
+    LoadedFonts* loaded_fonts;
+    uint32_t* language_idxs;
+    uint32_t language_count;
+    volatile gint* next_job;
+    uint32_t problem_count;
+} CheckWorker;
+
+static gpointer check_worker_main(gpointer data) {
+    CheckWorker* worker = data;
+    InputCsv* input = worker->input;
+
+    // pango contexts and font maps aren't shareable between threads, so each
+    // worker gets its own
+    PangoContext* context = pango_font_map_create_context(pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT));
+    ShimRenderer* renderer = shim_renderer_new(worker->loaded_fonts);
+    renderer->write_debug_output = false;
+    Arena arena = arena_create();
+
+    uint32_t job_count = worker->language_count * input->strings_count;
+
+    for (;;) {
+        uint32_t job = g_atomic_int_add(worker->next_job, 1);
+        if (job >= job_count) break;
+
+        uint32_t language_idx = worker->language_idxs[job / input->strings_count];
+        uint32_t string_idx = job % input->strings_count;
+
+        render_string_entry(&arena, context, renderer, input, language_idx, string_idx);
+        arena_clear(&arena);
     }
 
-    Arena base_arena = arena_create();
+    worker->problem_count = renderer->problem_count;
 
-    InputCsv input = parse_input_files(&base_arena);
-    if (input.cached_hash_matched) {
-        return 0;
+    arena_destroy(&arena);
+    g_object_unref(renderer);
+    g_object_unref(context);
+    return NULL;
+}
+
+static uint32_t check_strings_parallel(InputCsv* input, LoadedFonts* loaded_fonts, uint32_t* language_idxs, uint32_t language_count) {
+    uint32_t thread_count = g_get_num_processors();
+    volatile gint next_job = 0;
+
+    Arena scratch = arena_create();
+    CheckWorker* workers = arena_alloc(&scratch, thread_count * sizeof(CheckWorker));
+    GThread** threads = arena_alloc(&scratch, thread_count * sizeof(GThread*));
+
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        workers[i] = (CheckWorker){
+            .input = input,
+            .loaded_fonts = loaded_fonts,
+            .language_idxs = language_idxs,
+            .language_count = language_count,
+            .next_job = &next_job,
+        };
+        threads[i] = g_thread_new("textc-check", check_worker_main, &workers[i]);
     }
 
-    uint32_t lang_idx = 0;
-    for (; lang_idx < input.language_count; ++lang_idx) {
-        if (!strcmp(input.languages[lang_idx], argv[1])) break;
+    uint32_t problem_count = 0;
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        g_thread_join(threads[i]);
+        problem_count += workers[i].problem_count;
     }
-    if (lang_idx == input.language_count) {
-        fprintf(stderr, "language key not present strings.csv: '%s'", argv[1]);
-        return 1;
+
+    arena_destroy(&scratch);
+    return problem_count;
+}
+
+// -----------------------------------------------------------------------------
+// output file
+
+#define TEXTC_FILE_MAGIC 0x00545854  // TXT
+#define TEXTC_FILE_VERSION 3
+
+#define TEXTC_FLAG_DELTA_POSITIONS (1 << 0)
+#define TEXTC_FLAG_GLYPH_TILES (1 << 1)
+#define TEXTC_FLAG_SOA_VERTICES (1 << 2)
+
+static uint32_t find_used_glyph_index(ShimRenderer* renderer, uint64_t glyph_uid) {
+    uint32_t idx = GPOINTER_TO_UINT(g_hash_table_lookup(renderer->used_glyph_idxs, &glyph_uid));
+    if (idx == 0) Panic("glyph missing from used glyphs: %llx", (unsigned long long)glyph_uid);
+    return idx - 1;
+}
+
+// used glyph index of every glyph on the page, looked up once for all the
+// page writers
+static uint32_t* find_page_glyph_indices(Arena* arena, ShimRenderer* renderer, RenderedPage* page) {
+    uint32_t* ret = arena_alloc(arena, page->typeset_glyph_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < page->typeset_glyph_count; ++i) {
+        ret[i] = find_used_glyph_index(renderer, page->typeset_glyphs[i].glyph_uid);
     }
+    return ret;
+}
 
-    PangoContext* context = pango_font_map_create_context(pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT));
-    LoadedFonts loaded_fonts = load_fonts(&base_arena);
-    ShimRenderer* renderer = shim_renderer_new(&loaded_fonts);
-    ArenaOf(RenderedString) results = arena_create();
+static int16_t quantize_delta(float value) {
+    float q = roundf(value * DELTA_POSITION_QUANT);
+    if (q < INT16_MIN || q > INT16_MAX) Panic("delta encoded position out of range, logically adjacent glyphs over 2047px apart: %f", value);
+    return (int16_t)q;
+}
+
+static uint16_t quantize_size(float value) {
+    float q = roundf(value * DELTA_POSITION_QUANT);
+    if (q < 0 || q > UINT16_MAX) Panic("delta encoded glyph size out of range: %f", value);
+    return (uint16_t)q;
+}
+
+// glyphs registered after the atlas was baked (only possible in server mode)
+// get zeroed uvs
+static void write_page_vertices(FILE* file, RenderedPage* page, uint32_t* glyph_idxs, AtlasGlyphUv* glyph_uvs, uint32_t glyph_uv_count) {
+    static const AtlasGlyphUv no_uv = {0};
+
+    uint32_t vertex_count = 4 * page->typeset_glyph_count;
+    fwrite(&vertex_count, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < page->typeset_glyph_count; ++i) {
+        TypesetGlyph* glyph = &page->typeset_glyphs[i];
+        uint32_t idx = glyph_idxs[i];
+        const AtlasGlyphUv* uv = idx < glyph_uv_count ? &glyph_uvs[idx] : &no_uv;
+
+#define X(a, b)                                   \
+    fwrite(&glyph->x##a, sizeof(float), 1, file); \
+    fwrite(&glyph->y##b, sizeof(float), 1, file); \
+    fwrite(&uv->u##a, sizeof(float), 1, file);    \
+    fwrite(&uv->v##b, sizeof(float), 1, file);
+
+        X(0, 0);
+        X(0, 1);
+        X(1, 1);
+        X(1, 0);
+
+#undef X
+    }
+}
+
+// Glyphs are in logical order, so consecutive glyphs sharing a baseline form a
+// line. Each line stores the quantized x of its first glyph, and the rest of
+// the line is differenced from there, so deltas stay around one advance wide
+// however wide or offset the line is. Quantizing before differencing means a
+// prefix sum per line reproduces the positions exactly without drift.
+typedef struct {
+    float baseline_y;
+    int32_t x_origin;
+    uint32_t end_idx;
+} DeltaLine;
+
+static void write_page_glyphs_delta(FILE* file, RenderedPage* page, uint32_t* glyph_idxs) {
+    static const uint32_t zeroes = 0;
+    uint32_t count = page->typeset_glyph_count;
 
-    Log("shaping text...");
-    for (int32_t i = 0; i < input.strings_count; ++i) {
-        RenderedString rendered = render_string_entry(&base_arena, context, renderer, &input, lang_idx, i);
-        if (input.strings[i].width > 0) {
-            *ArenaPushT(RenderedString, &results) = rendered;
+    Arena scratch = arena_create();
+    int16_t* dx = arena_alloc(&scratch, count * sizeof(int16_t));
+    int16_t* dy = arena_alloc(&scratch, count * sizeof(int16_t));
+    uint16_t* w = arena_alloc(&scratch, count * sizeof(uint16_t));
+    uint16_t* h = arena_alloc(&scratch, count * sizeof(uint16_t));
+    uint16_t* glyph_idx = arena_alloc(&scratch, count * sizeof(uint16_t));
+    ArenaOf(DeltaLine) lines = arena_create();
+    DeltaLine* line = NULL;
+
+    int32_t prev_x = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        TypesetGlyph* glyph = &page->typeset_glyphs[i];
+        int32_t x = (int32_t)roundf(glyph->x0 * DELTA_POSITION_QUANT);
+
+        if (i == 0 || glyph->baseline_y != page->typeset_glyphs[i - 1].baseline_y) {
+            if (line) line->end_idx = i;
+            line = ArenaPushT(DeltaLine, &lines);
+            line->baseline_y = glyph->baseline_y;
+            line->x_origin = x;
+            prev_x = x;
         }
+
+        dx[i] = quantize_delta((float)(x - prev_x) / DELTA_POSITION_QUANT);
+        dy[i] = quantize_delta(glyph->y0 - glyph->baseline_y);
+        w[i] = quantize_size(glyph->x1 - glyph->x0);
+        h[i] = quantize_size(glyph->y1 - glyph->y0);
+        prev_x = x;
+
+        uint32_t idx = glyph_idxs[i];
+        if (idx > UINT16_MAX) Panic("too many glyphs for delta encoded output");
+        glyph_idx[i] = (uint16_t)idx;
+    }
+    if (line) line->end_idx = count;
+
+    uint32_t line_count = ArenaCountT(DeltaLine, &lines);
+    fwrite(&count, sizeof(uint32_t), 1, file);
+    fwrite(&line_count, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < line_count; ++i) {
+        DeltaLine* line = ArenaGetT(DeltaLine, &lines, i);
+        fwrite(&line->baseline_y, sizeof(float), 1, file);
+        fwrite(&line->x_origin, sizeof(int32_t), 1, file);
+        fwrite(&line->end_idx, sizeof(uint32_t), 1, file);
+    }
+    fwrite(dx, sizeof(int16_t), count, file);
+    fwrite(dy, sizeof(int16_t), count, file);
+    fwrite(w, sizeof(uint16_t), count, file);
+    fwrite(h, sizeof(uint16_t), count, file);
+    fwrite(glyph_idx, sizeof(uint16_t), count, file);
+    fwrite(&zeroes, sizeof(char), -(5 * count * sizeof(uint16_t)) & 3, file);
+
+    arena_destroy(&scratch);
+    arena_destroy(&lines);
+}
+
+// Same vertices as write_page_vertices, but as separate position and uv arrays.
+// Both start SOA_ARRAY_ALIGNMENT aligned relative to the start of the file (the
+// response payload in server mode, which is written to a stream of its own) and
+// are padded with zeroed vertices to a multiple of SOA_VERTEX_PADDING, so
+// per-frame position transforms can run over whole SIMD registers.
+static void write_page_vertices_soa(FILE* file, RenderedPage* page, uint32_t* glyph_idxs, AtlasGlyphUv* glyph_uvs, uint32_t glyph_uv_count) {
+    static const uint8_t zeroes[SOA_ARRAY_ALIGNMENT] = {0};
+    static const AtlasGlyphUv no_uv = {0};
+
+    uint32_t vertex_count = 4 * page->typeset_glyph_count;
+    uint32_t padded_count = (vertex_count + SOA_VERTEX_PADDING - 1) & ~(SOA_VERTEX_PADDING - 1);
+    fwrite(&vertex_count, sizeof(uint32_t), 1, file);
+    fwrite(zeroes, 1, -ftell(file) & (SOA_ARRAY_ALIGNMENT - 1), file);
+
+    Arena scratch = arena_create();
+    float* positions = arena_alloc(&scratch, padded_count * 2 * sizeof(float));
+    float* uvs = arena_alloc(&scratch, padded_count * 2 * sizeof(float));
+    memset(positions, 0, padded_count * 2 * sizeof(float));
+    memset(uvs, 0, padded_count * 2 * sizeof(float));
+
+    float* pos_write = positions;
+    float* uv_write = uvs;
+    for (uint32_t i = 0; i < page->typeset_glyph_count; ++i) {
+        TypesetGlyph* glyph = &page->typeset_glyphs[i];
+        uint32_t idx = glyph_idxs[i];
+        const AtlasGlyphUv* uv = idx < glyph_uv_count ? &glyph_uvs[idx] : &no_uv;
+
+#define X(a, b)                \
+    *pos_write++ = glyph->x##a; \
+    *pos_write++ = glyph->y##b; \
+    *uv_write++ = uv->u##a;     \
+    *uv_write++ = uv->v##b;
+
+        X(0, 0);
+        X(0, 1);
+        X(1, 1);
+        X(1, 0);
+
+#undef X
     }
 
-    AtlasGlyphUv* glyph_uvs = bake_used_glyphs_to_atlas_cached(&base_arena, renderer, input.hash);
+    fwrite(positions, sizeof(float), padded_count * 2, file);
+    fwrite(uvs, sizeof(float), padded_count * 2, file);
 
-    FILE* file = fopen("bin/strings.txtc", "wb+");
+    arena_destroy(&scratch);
+}
 
-    FWriteValue(uint32_t, 0x00545854, file);  // filetype bytes: TXTv (high byte is version)
+static void write_page(FILE* file, uint32_t format_flags, RenderedPage* page, uint32_t* glyph_idxs, AtlasGlyphUv* glyph_uvs, uint32_t glyph_uv_count) {
+    fwrite(&page->scale, sizeof(float), 1, file);
+    fwrite(&page->user_tag_count, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < page->user_tag_count; ++i) {
+        UserTag* tag = &page->user_tags[i];
 
-    fwrite(&input.strings_count, sizeof(uint32_t), 1, file);
-    for (uint32_t i = 0; i < ArenaCountT(RenderedString, &results); ++i) {
-        RenderedString* str = ArenaGetT(RenderedString, &results, i);
+        file_write_padded_string(file, tag->value, tag->value_len);
+        fwrite(&tag->start_idx, sizeof(uint32_t), 1, file);
+        fwrite(&tag->end_idx, sizeof(uint32_t), 1, file);
+    }
 
-        file_write_padded_string(file, input.strings[i].key, strnlen(input.strings[i].key, 255));
-        fwrite(&input.strings[i].width, sizeof(uint32_t), 1, file);
-        fwrite(&input.strings[i].height, sizeof(uint32_t), 1, file);
+    if (format_flags & TEXTC_FLAG_DELTA_POSITIONS) {
+        write_page_glyphs_delta(file, page, glyph_idxs);
+    } else {
+        if (format_flags & TEXTC_FLAG_SOA_VERTICES) {
+            write_page_vertices_soa(file, page, glyph_idxs, glyph_uvs, glyph_uv_count);
+        } else {
+            write_page_vertices(file, page, glyph_idxs, glyph_uvs, glyph_uv_count);
+        }
+        if (format_flags & TEXTC_FLAG_GLYPH_TILES) {
+            for (uint32_t i = 0; i < page->typeset_glyph_count; ++i) {
+                uint32_t idx = glyph_idxs[i];
+                FWriteValue(uint32_t, idx < glyph_uv_count ? idx : GLYPH_TILE_NONE, file);
+            }
+        }
+    }
+}
+
+static void write_textc_file(
+    char* path,
+    char* atlas_name,
+    uint32_t format_flags,
+    InputCsv* input,
+    RenderedString* strings,
+    uint32_t string_count,
+    ShimRenderer* renderer,
+    AtlasGlyphUv* glyph_uvs
+) {
+    FILE* file = fopen(path, "wb+");
+    if (file == NULL) Panic("Failed to open file: %s", path);
+    Arena scratch = arena_create();
+
+    FWriteValue(uint32_t, TEXTC_FILE_MAGIC | (TEXTC_FILE_VERSION << 24), file);  // filetype bytes: TXTv (high byte is version)
+    fwrite(&format_flags, sizeof(uint32_t), 1, file);
+    file_write_padded_string(file, atlas_name, strnlen(atlas_name, 255));
+
+    uint32_t used_glyph_count = ArenaCountT(GlyphId, &renderer->used_glyphs);
+    if (format_flags & TEXTC_FLAG_DELTA_POSITIONS) {
+        fwrite(&used_glyph_count, sizeof(uint32_t), 1, file);
+        fwrite(glyph_uvs, sizeof(AtlasGlyphUv), used_glyph_count, file);
+    }
+
+    fwrite(&string_count, sizeof(uint32_t), 1, file);
+    for (uint32_t i = 0; i < string_count; ++i) {
+        RenderedString* str = &strings[i];
+        StringsCsvEntry* entry = &input->strings[str->string_idx];
+
+        file_write_padded_string(file, entry->key, strnlen(entry->key, 255));
+        fwrite(&entry->width, sizeof(uint32_t), 1, file);
+        fwrite(&entry->height, sizeof(uint32_t), 1, file);
 
         fwrite(&str->page_count, sizeof(uint32_t), 1, file);
         for (uint32_t j = 0; j < str->page_count; ++j) {
-            RenderedPage* page = &str->pages[j];
+            arena_clear(&scratch);
+            uint32_t* glyph_idxs = find_page_glyph_indices(&scratch, renderer, &str->pages[j]);
+            write_page(file, format_flags, &str->pages[j], glyph_idxs, glyph_uvs, used_glyph_count);
+        }
+    }
 
-            fwrite(&page->user_tag_count, sizeof(uint32_t), 1, file);
-            for (uint32_t k = 0; k < page->user_tag_count; ++k) {
-                UserTag* tag = &page->user_tags[k];
+    arena_destroy(&scratch);
+    fclose(file);
+}
 
-                file_write_padded_string(file, tag->value, tag->value_len);
-                fwrite(&tag->start_idx, sizeof(uint32_t), 1, file);
-                fwrite(&tag->end_idx, sizeof(uint32_t), 1, file);
-            }
+// -----------------------------------------------------------------------------
+// layout server
+//
+// Keeps fonts, styles, the renderer and its glyph registry resident and answers
+// requests over a unix domain socket, one client at a time. Every message in
+// either direction is a u32 byte length followed by the payload.
+//
+// request:
+//     u32 kind;  // SERVER_REQUEST_MEASURE or SERVER_REQUEST_MESH
+//     u32 width;
+//     u32 height;
+//     u8[] markup;  // rest of the message
+//
+// response:
+//     u32 problem_count;  // markup/layout problems, details go to the server's stderr
+//     u32 num_pages;
+//     for num_pages {
+//         i32 layout_width, layout_height;
+//         u32 missing_glyph_count;  // glyphs no loaded font has
+//         u32 unbaked_glyph_count;  // glyphs not in the atlas baked at startup, their uvs are zero
+//                                   // and their tile index is GLYPH_TILE_NONE
+//         if kind == SERVER_REQUEST_MESH {
+//             page as in the .txtc file, using the server's --soa/--tiles settings
+//             (--delta is rejected in server mode); soa arrays are aligned
+//             relative to the start of the response payload
+//         }
+//     }
+
+#define SERVER_REQUEST_MEASURE 0
+#define SERVER_REQUEST_MESH 1
 
-            uint32_t vertex_count = 4 * page->typeset_glyph_count;
-            fwrite(&vertex_count, sizeof(uint32_t), 1, file);
-            for (uint32_t k = 0; k < page->typeset_glyph_count; ++k) {
-                TypesetGlyph* glyph = &page->typeset_glyphs[k];
-
-                uint32_t idx = UINT32_MAX;
-                for (uint32_t j = 0; j < ArenaCountT(GlyphId, &renderer->used_glyphs); ++j) {
-                    GlyphId* gid = ArenaGetT(GlyphId, &renderer->used_glyphs, j);
-                    if (glyph->glyph_uid == gid->uid) {
-                        idx = j;
-                        break;
-                    }
-                }
-                Assert(idx < UINT32_MAX);
+typedef struct {
+    uint32_t kind;
+    uint32_t width;
+    uint32_t height;
+} ServerRequestHeader;
+
+static bool socket_write_exact(int32_t fd, const void* data, size_t size) {
+    const uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t sent = send(fd, ptr, size, 0);
+        if (sent <= 0) return false;
+        ptr += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool socket_read_exact(int32_t fd, void* data, size_t size) {
+    uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t got = recv(fd, ptr, size, 0);
+        if (got <= 0) return false;
+        ptr += got;
+        size -= got;
+    }
+    return true;
+}
 
-#define X(a, b)                                           \
-    fwrite(&glyph->x##a, sizeof(float), 1, file);         \
-    fwrite(&glyph->y##b, sizeof(float), 1, file);         \
-    fwrite(&glyph_uvs[idx].u##a, sizeof(float), 1, file); \
-    fwrite(&glyph_uvs[idx].v##b, sizeof(float), 1, file);
+static bool socket_write_message(int32_t fd, const void* data, uint32_t length) {
+    return socket_write_exact(fd, &length, sizeof(uint32_t)) && socket_write_exact(fd, data, length);
+}
 
-                X(0, 0);
-                X(0, 1);
-                X(1, 1);
-                X(1, 0);
+// returns NULL on disconnect or a message over SERVER_MAX_MESSAGE_SIZE, either
+// way the connection should be dropped
+static char* socket_read_message(Arena* arena, int32_t fd, uint32_t* out_length) {
+    uint32_t length;
+    if (!socket_read_exact(fd, &length, sizeof(uint32_t))) return NULL;
+    if (length > SERVER_MAX_MESSAGE_SIZE) return NULL;
+    char* ret = arena_alloc(arena, (size_t)length + 1);
+    if (!socket_read_exact(fd, ret, length)) return NULL;
+    ret[length] = 0;
+    *out_length = length;
+    return ret;
+}
 
-#undef X
+static struct sockaddr_un socket_address(char* path) {
+    struct sockaddr_un ret = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(ret.sun_path)) Panic("socket path too long: %s", path);
+    strcpy(ret.sun_path, path);
+    return ret;
+}
+
+static void serve_request(
+    Arena* arena,
+    FILE* out,
+    PangoContext* context,
+    ShimRenderer* renderer,
+    InputCsv* input,
+    char* language,
+    uint32_t format_flags,
+    AtlasGlyphUv* glyph_uvs,
+    uint32_t glyph_uv_count,
+    ServerRequestHeader* request,
+    char* markup
+) {
+    StringsCsvEntry entry = {
+        .key = "request",
+        .width = request->width,
+        .height = request->height,
+    };
+
+    uint32_t problem_count = renderer->problem_count;
+    RenderedString rendered = render_markup(arena, context, renderer, input, language, &entry, markup);
+    problem_count = renderer->problem_count - problem_count;
+
+    fwrite(&problem_count, sizeof(uint32_t), 1, out);
+    fwrite(&rendered.page_count, sizeof(uint32_t), 1, out);
+    for (uint32_t i = 0; i < rendered.page_count; ++i) {
+        RenderedPage* page = &rendered.pages[i];
+
+        uint32_t* glyph_idxs = find_page_glyph_indices(arena, renderer, page);
+        uint32_t unbaked_glyph_count = 0;
+        for (uint32_t j = 0; j < page->typeset_glyph_count; ++j) {
+            if (glyph_idxs[j] >= glyph_uv_count) unbaked_glyph_count++;
+        }
+
+        fwrite(&page->layout_width, sizeof(int32_t), 1, out);
+        fwrite(&page->layout_height, sizeof(int32_t), 1, out);
+        fwrite(&page->missing_glyph_count, sizeof(uint32_t), 1, out);
+        fwrite(&unbaked_glyph_count, sizeof(uint32_t), 1, out);
+
+        if (request->kind == SERVER_REQUEST_MESH) {
+            write_page(out, format_flags, page, glyph_idxs, glyph_uvs, glyph_uv_count);
+        }
+    }
+}
+
+static int32_t run_server(
+    char* socket_path,
+    PangoContext* context,
+    ShimRenderer* renderer,
+    InputCsv* input,
+    char* language,
+    uint32_t format_flags,
+    AtlasGlyphUv* glyph_uvs,
+    uint32_t glyph_uv_count
+) {
+    int32_t listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) Panic("socket failed");
+
+    struct sockaddr_un addr = socket_address(socket_path);
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) Panic("failed to bind socket: %s", socket_path);
+    if (listen(listen_fd, 8) == -1) Panic("listen failed");
+
+    // a client hanging up mid-response shouldn't take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+    Arena request_arena = arena_create();
+
+    Log("serving %s on %s", language, socket_path);
+    for (;;) {
+        int32_t client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1) continue;
+
+        for (;;) {
+            arena_clear(&request_arena);
+
+            uint32_t length;
+            char* message = socket_read_message(&request_arena, client_fd, &length);
+            if (message == NULL || length < sizeof(ServerRequestHeader)) break;
+
+            ServerRequestHeader request;
+            memcpy(&request, message, sizeof(ServerRequestHeader));
+
+            char* response = NULL;
+            size_t response_size = 0;
+            FILE* out = open_memstream(&response, &response_size);
+            serve_request(
+                &request_arena, out, context, renderer, input, language, format_flags, glyph_uvs, glyph_uv_count,
+                &request, message + sizeof(ServerRequestHeader)
+            );
+            fclose(out);
+
+            bool sent = socket_write_message(client_fd, response, response_size);
+            free(response);
+            if (!sent) break;
+        }
+
+        close(client_fd);
+    }
+}
+
+static int32_t sort_cmp_int64(const void* va, const void* vb) {
+    const int64_t *a = va, *b = vb;
+    return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+// load test client for run_server, times SERVER_BENCH_REQUEST_COUNT mesh
+// requests of the same markup round trip
+static int32_t run_server_bench(char* socket_path, char* markup) {
+    int32_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) Panic("socket failed");
+
+    struct sockaddr_un addr = socket_address(socket_path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "failed to connect to %s\n", socket_path);
+        return 1;
+    }
+
+    Arena arena = arena_create();
+    Arena response_arena = arena_create();
+
+    ServerRequestHeader header = {.kind = SERVER_REQUEST_MESH, .width = 1000, .height = 1000};
+    uint32_t markup_len = strlen(markup);
+    uint32_t request_len = sizeof(ServerRequestHeader) + markup_len;
+    char* request = arena_alloc(&arena, request_len);
+    memcpy(request, &header, sizeof(ServerRequestHeader));
+    memcpy(request + sizeof(ServerRequestHeader), markup, markup_len);
+
+    int64_t* latencies = arena_alloc(&arena, SERVER_BENCH_REQUEST_COUNT * sizeof(int64_t));
+    int64_t start = g_get_monotonic_time();
+
+    for (uint32_t i = 0; i < SERVER_BENCH_REQUEST_COUNT; ++i) {
+        int64_t t0 = g_get_monotonic_time();
+
+        uint32_t response_len;
+        if (!socket_write_message(fd, request, request_len) || !socket_read_message(&response_arena, fd, &response_len)) {
+            fprintf(stderr, "server closed the connection\n");
+            return 1;
+        }
+        arena_clear(&response_arena);
+
+        latencies[i] = g_get_monotonic_time() - t0;
+    }
+
+    int64_t total = g_get_monotonic_time() - start;
+    qsort(latencies, SERVER_BENCH_REQUEST_COUNT, sizeof(int64_t), sort_cmp_int64);
+
+    Log("%u requests in %.3fs, %.0f req/s", SERVER_BENCH_REQUEST_COUNT, total / 1e6, SERVER_BENCH_REQUEST_COUNT / (total / 1e6));
+    Log(
+        "latency us: min %lld, p50 %lld, p99 %lld, max %lld",
+        (long long)latencies[0],
+        (long long)latencies[SERVER_BENCH_REQUEST_COUNT / 2],
+        (long long)latencies[SERVER_BENCH_REQUEST_COUNT * 99 / 100],
+        (long long)latencies[SERVER_BENCH_REQUEST_COUNT - 1]
+    );
+
+    close(fd);
+    arena_destroy(&arena);
+    arena_destroy(&response_arena);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+    char** languages;
+    uint32_t language_count;
+    uint32_t format_flags;
+    bool check_only;
+    char* serve_socket_path;
+    char* bench_socket_path;
+} CliOptions;
+
+static CliOptions parse_cli_options(int argc, char** argv) {
+    CliOptions ret = {0};
+    ret.languages = calloc(argc, sizeof(char*));
+    for (int32_t i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--delta")) {
+            ret.format_flags |= TEXTC_FLAG_DELTA_POSITIONS;
+        } else if (!strcmp(argv[i], "--soa")) {
+            ret.format_flags |= TEXTC_FLAG_SOA_VERTICES;
+        } else if (!strcmp(argv[i], "--tiles")) {
+            ret.format_flags |= TEXTC_FLAG_GLYPH_TILES;
+        } else if (!strcmp(argv[i], "--check")) {
+            ret.check_only = true;
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            ret.serve_socket_path = argv[++i];
+        } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            ret.bench_socket_path = argv[++i];
+        } else if (!strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "unknown option: '%s'\n", argv[i]);
+            exit(1);
+        } else {
+            ret.languages[ret.language_count++] = argv[i];
+        }
+    }
+    if ((ret.format_flags & TEXTC_FLAG_DELTA_POSITIONS) && (ret.format_flags & TEXTC_FLAG_SOA_VERTICES)) {
+        fprintf(stderr, "--delta and --soa can't be combined\n");
+        exit(1);
+    }
+    if ((ret.format_flags & TEXTC_FLAG_DELTA_POSITIONS) && ret.serve_socket_path) {
+        // delta glyphs index the uv table in the .txtc header, which responses don't carry
+        fprintf(stderr, "--delta and --serve can't be combined\n");
+        exit(1);
+    }
+    return ret;
+}
+
+// anything that changes the outputs for the same csv files goes in here
+static uint32_t hash_cli_options(CliOptions* options) {
+    uint32_t hash = HASH_DJB2_INIT;
+    hash_djb2_acc(&hash, &options->format_flags, sizeof(options->format_flags), 1);
+    for (uint32_t i = 0; i < options->language_count; ++i) {
+        hash_djb2_acc(&hash, options->languages[i], strlen(options->languages[i]) + 1, 1);
+    }
+    return hash;
+}
+
+int main(int argc, char** argv) {
+    CliOptions options = parse_cli_options(argc, argv);
+
+    if (options.bench_socket_path) {
+        return run_server_bench(options.bench_socket_path, options.language_count > 0 ? options.languages[0] : "[#-title]Hello, [#b]world[#/]!");
+    }
+
+    if ((options.language_count == 0 && !options.check_only) || (options.serve_socket_path && options.language_count != 1)) {
+        fprintf(stderr, "Usage: textc [--delta | --soa] [--tiles] [language...]\n");
+        fprintf(stderr, "       textc --check [language...]\n");
+        fprintf(stderr, "       textc [--soa] [--tiles] --serve <socket path> <language>\n");
+        fprintf(stderr, "       textc --bench <socket path> [markup]\n");
+        return 1;
+    }
+
+    Arena base_arena = arena_create();
+
+    bool use_cache = !options.check_only && !options.serve_socket_path;
+    InputCsv input = parse_input_files(&base_arena, hash_cli_options(&options), use_cache);
+    if (input.cached_hash_matched) {
+        return 0;
+    }
+
+    uint32_t* lang_idxs = arena_alloc(&base_arena, input.language_count * sizeof(uint32_t));
+    uint32_t lang_count = options.language_count;
+    if (lang_count == 0) {
+        lang_count = input.language_count;
+        for (uint32_t i = 0; i < lang_count; ++i) lang_idxs[i] = i;
+    }
+    for (uint32_t i = 0; i < options.language_count; ++i) {
+        uint32_t lang_idx = 0;
+        for (; lang_idx < input.language_count; ++lang_idx) {
+            if (!strcmp(input.languages[lang_idx], options.languages[i])) break;
+        }
+        if (lang_idx == input.language_count || i >= input.language_count) {
+            fprintf(stderr, "language key not present strings.csv: '%s'", options.languages[i]);
+            return 1;
+        }
+        lang_idxs[i] = lang_idx;
+    }
+
+    LoadedFonts loaded_fonts = load_fonts(&base_arena);
+    uint32_t problem_count = check_style_fonts(&input, &loaded_fonts);
+
+    if (options.check_only) {
+        if (problem_count == 0) {
+            Log("checking strings...");
+            problem_count = check_strings_parallel(&input, &loaded_fonts, lang_idxs, lang_count);
+        }
+        if (problem_count > 0) {
+            fprintf(stderr, "textc: %u problems found\n", problem_count);
+            return 1;
+        }
+        Log("no problems found");
+        return 0;
+    }
+    if (problem_count > 0) return 1;
+
+    PangoContext* context = pango_font_map_create_context(pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT));
+    ShimRenderer* renderer = shim_renderer_new(&loaded_fonts);
+    renderer->write_debug_output = !options.serve_socket_path;
+    ArenaOf(RenderedString) results = arena_create();
+    GlyphBitmapCache glyph_cache = {0};
+
+    // With several languages each one gets its own atlas holding only the glyphs
+    // it uses, all packed from the shared glyph bitmap cache.
+    for (uint32_t l = 0; l < lang_count; ++l) {
+        char* language = input.languages[lang_idxs[l]];
+        char atlas_name[256];
+        char atlas_path[256];
+        char strings_path[256];
+        bool tiles = options.format_flags & TEXTC_FLAG_GLYPH_TILES;
+        if (options.serve_socket_path) {
+            // kept apart from the build outputs so a server never leaves them mismatched
+            snprintf(atlas_name, 256, tiles ? "glyphs.serve.tiles" : "atlas.serve.png");
+        } else if (lang_count == 1) {
+            snprintf(atlas_name, 256, tiles ? "glyphs.tiles" : "atlas.png");
+            snprintf(strings_path, 256, "bin/strings.txtc");
+        } else {
+            snprintf(atlas_name, 256, tiles ? "glyphs.%s.tiles" : "atlas.%s.png", language);
+            snprintf(strings_path, 256, "bin/strings.%s.txtc", language);
+        }
+        snprintf(atlas_path, 256, "bin/%s", atlas_name);
+
+        arena_clear(&renderer->used_glyphs);
+        shim_renderer_index_used_glyphs(renderer);
+        arena_clear(&results);
+
+        Log("shaping %s text...", language);
+        Progress progress = progress_begin("strings", input.strings_count);
+        for (int32_t i = 0; i < input.strings_count; ++i) {
+            RenderedString rendered = render_string_entry(&base_arena, context, renderer, &input, lang_idxs[l], i);
+            if (input.strings[i].width > 0) {
+                *ArenaPushT(RenderedString, &results) = rendered;
             }
+            progress_step(&progress);
         }
+        progress_end(&progress);
+
+        AtlasGlyphUv* glyph_uvs = bake_used_glyphs_to_atlas_cached(&base_arena, renderer, &glyph_cache, atlas_path, tiles, use_cache);
+
+        if (options.serve_socket_path) {
+            glyph_bitmap_cache_save(&glyph_cache);
+            return run_server(
+                options.serve_socket_path, context, renderer, &input, language, options.format_flags,
+                glyph_uvs, ArenaCountT(GlyphId, &renderer->used_glyphs)
+            );
+        }
+
+        write_textc_file(
+            strings_path, atlas_name, options.format_flags, &input,
+            (RenderedString*)results.head, ArenaCountT(RenderedString, &results), renderer, glyph_uvs
+        );
     }
 
-    fclose(file);
+    glyph_bitmap_cache_save(&glyph_cache);
+    write_cached_input_hash(input.hash);
+
     Log("done");
     return 0;
-}
\ No newline at end of file
+}